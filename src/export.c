@@ -0,0 +1,368 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "palette.h"
+
+#define BLOCK_ROWS 256 /* Instructions rendered by one thread at once */
+#define CELL_W 8       /* SVG cell width (pixels) */
+#define CELL_H 14      /* SVG cell height (pixels) */
+#define LABEL_W 400    /* SVG room for the labels (pixels) */
+#define MAX_COLS 1024  /* Cycles shown per row for instruction ranges */
+#define RULER_STEP 20  /* Cycles between two ruler marks */
+#define NO_COLOR -1
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct export_ctx {
+    db_t *db;
+    export_format_t format;
+    export_range_t range;
+    size_t ncols; /* Cycles displayed per row */
+    int colors[2][PALETTE_SIZE]; /* 0xRRGGBB, same palette as the viewer */
+} export_ctx_t;
+
+typedef struct export_block {
+    export_ctx_t *ctx;
+    size_t first; /* Instructions [first:last[ */
+    size_t last;
+    size_t nb_rows; /* Lines rendered: rows not filtered out, and ruler */
+    size_t base;    /* Cycle of the first column */
+    char *buf;
+    size_t size;
+    pthread_t thread;
+} export_block_t;
+
+int export_format_parse(char *name, export_format_t *format) {
+    if (strcmp(name, "ansi") == 0) {
+        *format = EXPORT_ANSI;
+    } else if (strcmp(name, "html") == 0) {
+        *format = EXPORT_HTML;
+    } else if (strcmp(name, "svg") == 0) {
+        *format = EXPORT_SVG;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static bool export_row_visible(export_ctx_t *ctx, inst_t *inst) {
+    if (!inst->valid) return false;
+    if (!ctx->range.cycles) return true;
+    return inst->start_time < ctx->range.last &&
+           inst->end_time > ctx->range.first;
+}
+
+/* Cycle of the first column for the rows of a block: the range start, or
+ * like the viewer the start of the first instruction drawn */
+static size_t export_base(export_ctx_t *ctx, inst_t *inst) {
+    return ctx->range.cycles ? ctx->range.first : inst->start_time;
+}
+
+static int export_cell_color(export_ctx_t *ctx, inst_t *inst,
+                             inst_cell_t *cell) {
+    if (cell->stage == NULL) return NO_COLOR;
+    return ctx->colors[inst->flushed][palette_stage_coef(cell->stage)];
+}
+
+/* Write text for HTML/SVG */
+static void export_escape(FILE *f, char *str) {
+    for (; str && *str; str++) {
+        switch (*str) {
+            case '<':
+                fputs("&lt;", f);
+                break;
+            case '>':
+                fputs("&gt;", f);
+                break;
+            case '&':
+                fputs("&amp;", f);
+                break;
+            default:
+                fputc(*str, f);
+        }
+    }
+}
+
+/* `len` blank cells. Spaces for ANSI, so that the output survives a copy
+ * and paste; HTML uses a fixed width element instead. */
+static void export_skip(export_ctx_t *ctx, FILE *f, size_t len) {
+    if (len == 0) return;
+    switch (ctx->format) {
+        case EXPORT_ANSI:
+            fputs("\033[0m", f);
+            for (size_t i = 0; i < len; i++) fputc(' ', f);
+            break;
+        case EXPORT_HTML:
+            fprintf(f, "<span style=\"display:inline-block;width:%ldch\">"
+                       "</span>", len);
+            break;
+        case EXPORT_SVG:
+            break;
+    }
+}
+
+/* A run of identical cells */
+static void export_run(export_ctx_t *ctx, FILE *f, size_t x, size_t y,
+                       int color, char c, size_t len) {
+    switch (ctx->format) {
+        case EXPORT_ANSI:
+            if (color == NO_COLOR) {
+                fputs("\033[0m", f);
+            } else {
+                fprintf(f, "\033[37;48;2;%d;%d;%dm", color >> 16,
+                        (color >> 8) & 0xff, color & 0xff);
+            }
+            for (size_t i = 0; i < len; i++) fputc(c, f);
+            break;
+        case EXPORT_HTML: {
+            char str[2] = {c, '\0'};
+            if (color != NO_COLOR) {
+                fprintf(f, "<span style=\"background:#%06x\">", color);
+            }
+            for (size_t i = 0; i < len; i++) export_escape(f, str);
+            if (color != NO_COLOR) fputs("</span>", f);
+            break;
+        }
+        case EXPORT_SVG: {
+            if (color != NO_COLOR) {
+                fprintf(f,
+                        "<rect x=\"%ld\" y=\"%ld\" width=\"%ld\" "
+                        "height=\"%d\" fill=\"#%06x\"/>",
+                        x * CELL_W, y * CELL_H, len * CELL_W, CELL_H, color);
+            }
+            if (c != ' ' && c != '.') {  // Stage initial at the run start
+                char str[2] = {c, '\0'};
+                fprintf(f, "<text x=\"%ld\" y=\"%ld\">", x * CELL_W,
+                        (y + 1) * CELL_H - 3);
+                export_escape(f, str);
+                fputs("</text>", f);
+            }
+            break;
+        }
+    }
+}
+
+static void export_row(export_ctx_t *ctx, FILE *f, size_t id, size_t y,
+                       size_t base) {
+    inst_t *inst = &ctx->db->insts[id];
+    size_t ncols = ctx->ncols;
+
+    // Only the instruction lifetime is written, the blanks are skipped
+    size_t begin = 0, end = 0;
+    if (inst->start_time < base + ncols && inst->end_time > base) {
+        begin = MAX(inst->start_time, base) - base;
+        end = MIN(inst->end_time, base + ncols) - base;
+    }
+    export_skip(ctx, f, begin);
+
+    // Merge identical cells into runs
+    size_t run_x = 0, run_len = 0;
+    int run_color = NO_COLOR;
+    char run_c = ' ';
+    for (size_t x = begin; x < end; x++) {
+        inst_cell_t cell = inst_cell(inst, base + x);
+        int color = export_cell_color(ctx, inst, &cell);
+        if (run_len && (color != run_color || cell.c != run_c)) {
+            export_run(ctx, f, run_x, y, run_color, run_c, run_len);
+            run_len = 0;
+        }
+        if (run_len == 0) {
+            run_x = x;
+            run_color = color;
+            run_c = cell.c;
+        }
+        run_len++;
+    }
+    if (run_len) export_run(ctx, f, run_x, y, run_color, run_c, run_len);
+    export_skip(ctx, f, ncols - end);
+
+    switch (ctx->format) {
+        case EXPORT_ANSI:
+            fprintf(f, "\033[0m %8ld %s\n", id,
+                    inst->text_display ? inst->text_display : "");
+            break;
+        case EXPORT_HTML:
+            fprintf(f, " %8ld ", id);
+            export_escape(f, inst->text_display);
+            fputc('\n', f);
+            break;
+        case EXPORT_SVG:
+            fprintf(f, "<text x=\"%ld\" y=\"%ld\">%ld ", ncols * CELL_W + 4,
+                    (y + 1) * CELL_H - 3, id);
+            export_escape(f, inst->text_display);
+            fputs("</text>\n", f);
+            break;
+    }
+}
+
+/* Cycle numbers above the rows aligned on `base`: marks at round cycles,
+ * as many as fit */
+static void export_ruler(export_ctx_t *ctx, FILE *f, size_t y, size_t base) {
+    size_t col = 0;  // ANSI/HTML: characters written so far
+    if (ctx->format == EXPORT_ANSI) fputs("\033[0m", f);
+    for (size_t x = 0; x < ctx->ncols;) {
+        char mark[32];
+        size_t len = snprintf(mark, sizeof(mark), "|%ld", base + x);
+        len = MIN(len, ctx->ncols - x);
+        if (ctx->format == EXPORT_SVG) {
+            fprintf(f, "<text x=\"%ld\" y=\"%ld\">%.*s</text>", x * CELL_W,
+                    (y + 1) * CELL_H - 3, (int)len, mark);
+        } else {
+            for (; col < x; col++) fputc(' ', f);
+            fprintf(f, "%.*s", (int)len, mark);
+            col += len;
+        }
+        x += len + 1;
+        x += (RULER_STEP - (base + x) % RULER_STEP) % RULER_STEP;
+    }
+    if (ctx->format != EXPORT_SVG) {
+        for (; col < ctx->ncols; col++) fputc(' ', f);
+        fputs(" cycles", f);
+    }
+    fputc('\n', f);
+}
+
+static void *export_block(void *arg) {
+    export_block_t *block = arg;
+    export_ctx_t *ctx = block->ctx;
+    FILE *f = open_memstream(&block->buf, &block->size);
+    block->nb_rows = 0;
+    for (size_t id = block->first; id < block->last; id++) {
+        inst_t *inst = &ctx->db->insts[id];
+        if (!export_row_visible(ctx, inst)) continue;
+        if (block->nb_rows == 0) {
+            block->base = export_base(ctx, inst);
+            // Each block has its own base, show it
+            if (!ctx->range.cycles) {
+                export_ruler(ctx, f, block->nb_rows++, block->base);
+            }
+        }
+        export_row(ctx, f, id, block->nb_rows++, block->base);
+    }
+    fclose(f);
+    return NULL;
+}
+
+int export_db(db_t *db, FILE *out, export_format_t format,
+              export_range_t range) {
+    export_ctx_t ctx = {db, format, range, 0, {{0}}};
+    for (size_t dark = 0; dark <= 1; dark++) {
+        for (size_t c = 0; c < PALETTE_SIZE; c++) {
+            float rgb[3];
+            palette_rgb(c, dark, rgb);
+            ctx.colors[dark][c] = (int)(rgb[0] * 255) << 16 |
+                                  (int)(rgb[1] * 255) << 8 |
+                                  (int)(rgb[2] * 255);
+        }
+    }
+
+    // Instructions to go through
+    size_t first, last;
+    if (range.cycles) {
+        if (range.first >= range.last) return -1;
+        first = db_find_alive(db, range.first);
+        last = MIN(db_find_time(db, range.last - 1) + 1, db->nb_inst);
+    } else {
+        first = range.first;
+        last = MIN(range.last, db->nb_inst);
+    }
+    if (first >= last) return -1;
+
+    // Displayed cycles: the range, or enough for the longest block. Blocks
+    // of an instruction range get a ruler line.
+    size_t nb_rows = 0, nb_rulers = 0, base = 0, block = (size_t)-1;
+    for (size_t id = first; id < last; id++) {
+        inst_t *inst = &db->insts[id];
+        if (!export_row_visible(&ctx, inst)) continue;
+        nb_rows++;
+        if ((id - first) / BLOCK_ROWS != block) {
+            block = (id - first) / BLOCK_ROWS;
+            base = export_base(&ctx, inst);
+            nb_rulers += !range.cycles;
+        }
+        if (!range.cycles) ctx.ncols = MAX(ctx.ncols, inst->end_time - base);
+    }
+    if (nb_rows == 0) return -1;
+    if (range.cycles) {
+        ctx.ncols = range.last - range.first;
+    } else {
+        ctx.ncols = MIN(ctx.ncols, MAX_COLS);
+    }
+
+    // Header
+    size_t ncols = ctx.ncols;
+    switch (format) {
+        case EXPORT_ANSI:
+        case EXPORT_HTML:
+            if (format == EXPORT_HTML) {
+                fprintf(out,
+                        "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+                        "<title>%s</title></head>\n"
+                        "<body style=\"background:#000;color:#fff\"><pre>\n",
+                        db->filename);
+            }
+            fprintf(out, "%s: %ld instructions, ", db->filename, nb_rows);
+            if (range.cycles) {
+                fprintf(out, "cycles [%ld:%ld[\n", range.first, range.last);
+            } else {
+                fprintf(out, "%ld cycles from the first of every %d, "
+                        "see the rulers\n", ncols, BLOCK_ROWS);
+            }
+            break;
+        case EXPORT_SVG:
+            fprintf(out,
+                    "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                    "width=\"%ld\" height=\"%ld\" font-family=\"monospace\" "
+                    "font-size=\"%d\" fill=\"#fff\">\n"
+                    "<rect width=\"100%%\" height=\"100%%\" fill=\"#000\"/>\n",
+                    ncols * CELL_W + LABEL_W, (nb_rows + nb_rulers) * CELL_H,
+                    CELL_H - 3);
+            break;
+    }
+
+    // Rows: one block per thread, written in order. Memory is bounded by
+    // the blocks in flight.
+    long nb_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    export_block_t *blocks = calloc(nb_threads, sizeof(export_block_t));
+    size_t y = 0;
+    for (size_t id = first; id < last;) {
+        long n = 0;
+        for (; n < nb_threads && id < last; n++, id += BLOCK_ROWS) {
+            blocks[n].ctx = &ctx;
+            blocks[n].first = id;
+            blocks[n].last = MIN(id + BLOCK_ROWS, last);
+            pthread_create(&blocks[n].thread, NULL, export_block, &blocks[n]);
+        }
+        for (long b = 0; b < n; b++) {
+            pthread_join(blocks[b].thread, NULL);
+            if (format == EXPORT_SVG) {
+                fprintf(out, "<g transform=\"translate(0,%ld)\">\n",
+                        y * CELL_H);
+            }
+            fwrite(blocks[b].buf, 1, blocks[b].size, out);
+            if (format == EXPORT_SVG) fputs("</g>\n", out);
+            y += blocks[b].nb_rows;
+            free(blocks[b].buf);
+        }
+    }
+    free(blocks);
+
+    // Footer
+    switch (format) {
+        case EXPORT_ANSI:
+            break;
+        case EXPORT_HTML:
+            fputs("</pre></body></html>\n", out);
+            break;
+        case EXPORT_SVG:
+            fputs("</svg>\n", out);
+            break;
+    }
+    return ferror(out) ? -1 : 0;
+}
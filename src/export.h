@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "parser.h"
+
+typedef enum export_format {
+    EXPORT_ANSI,
+    EXPORT_HTML,
+    EXPORT_SVG,
+} export_format_t;
+
+/* Instructions [first:last[, or the instructions alive during the cycles
+ * [first:last[ when `cycles` is set */
+typedef struct export_range {
+    bool cycles;
+    size_t first;
+    size_t last;
+} export_range_t;
+
+int export_format_parse(char *name, export_format_t *format);
+int export_db(db_t *db, FILE *out, export_format_t format,
+              export_range_t range);
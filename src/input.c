@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "input.h"
+
+#define BLOCK_SIZE (1 << 20)   /* Decompressed bytes handed over at once */
+#define NB_BLOCKS 4            /* Blocks in flight between the threads */
+#define INPUT_SIZE (1 << 16)   /* Compressed bytes read at once */
+
+#define GZIP_MAGIC 0x8b1f
+#define ZSTD_MAGIC 0xFD2FB528
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEK_TABLE_MAGIC 0x184D2A5E
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static uint32_t rd32(unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Decoders */
+
+typedef struct decoder {
+    FILE *fp;  /* Compressed input */
+    off_t pos; /* Decompressed offset of the next decoded byte */
+    off_t size; /* Decompressed size, -1 if unknown */
+    /* Produce up to cap bytes: 0 at end of stream, -1 on error */
+    ssize_t (*decode)(struct decoder *d, char *buf, size_t cap);
+    /* Move the decoder at or before `pos`, where decoding forward is the
+     * cheapest way to reach it. Update d->pos accordingly. */
+    int (*restart)(struct decoder *d, off_t pos);
+    void (*close)(struct decoder *d);
+    void *state;
+} decoder_t;
+
+static ssize_t decoder_read(decoder_t *d, char *buf, size_t cap) {
+    ssize_t n = d->decode(d, buf, cap);
+    if (n > 0) d->pos += n;
+    return n;
+}
+
+/* Fill buf as much as possible */
+static ssize_t decoder_fill(decoder_t *d, char *buf, size_t cap) {
+    size_t n = 0;
+    while (n < cap) {
+        ssize_t ret = decoder_read(d, buf + n, cap - n);
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+        n += ret;
+    }
+    return n;
+}
+
+static int decoder_seek(decoder_t *d, off_t pos) {
+    char scratch[INPUT_SIZE];
+    if (d->restart(d, pos) != 0) return -1;
+    while (d->pos < pos) {
+        size_t len = MIN(sizeof(scratch), (size_t)(pos - d->pos));
+        if (decoder_read(d, scratch, len) <= 0) return -1;
+    }
+    return 0;
+}
+
+/* gzip (and concatenated gzip members) */
+
+typedef struct gz_state {
+    z_stream zs;
+    unsigned char in[INPUT_SIZE];
+} gz_state_t;
+
+static ssize_t gz_decode(decoder_t *d, char *buf, size_t cap) {
+    gz_state_t *gz = d->state;
+    z_stream *zs = &gz->zs;
+    zs->next_out = (Bytef *)buf;
+    zs->avail_out = cap;
+    while (zs->avail_out == cap) {
+        if (zs->avail_in == 0) {
+            zs->avail_in = fread(gz->in, 1, sizeof(gz->in), d->fp);
+            zs->next_in = gz->in;
+            // A truncated stream ends like a complete one
+            if (zs->avail_in == 0) break;
+        }
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            inflateReset(zs);
+        } else if (ret != Z_OK) {
+            return -1;
+        }
+    }
+    return cap - zs->avail_out;
+}
+
+static int gz_restart(decoder_t *d, off_t pos) {
+    gz_state_t *gz = d->state;
+    if (pos >= d->pos) return 0;
+    if (fseeko(d->fp, 0, SEEK_SET) != 0) return -1;
+    inflateReset(&gz->zs);
+    gz->zs.avail_in = 0;
+    d->pos = 0;
+    return 0;
+}
+
+static void gz_close(decoder_t *d) {
+    gz_state_t *gz = d->state;
+    inflateEnd(&gz->zs);
+    free(gz);
+}
+
+static int gz_init(decoder_t *d) {
+    gz_state_t *gz = calloc(1, sizeof(gz_state_t));
+    // 32: detect gzip/zlib header
+    if (gz == NULL || inflateInit2(&gz->zs, 15 + 32) != Z_OK) {
+        free(gz);
+        return -1;
+    }
+    d->state = gz;
+    d->decode = gz_decode;
+    d->restart = gz_restart;
+    d->close = gz_close;
+    return 0;
+}
+
+/* zstd, with the seek table of the seekable format when present */
+
+#ifdef HAVE_ZSTD
+typedef struct zs_state {
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input;
+    unsigned char in[INPUT_SIZE];
+    size_t nb_frames; /* 0 without seek table */
+    off_t *cstart;    /* Compressed offset of each frame */
+    off_t *dstart;    /* Decompressed offset of each frame */
+} zs_state_t;
+
+static ssize_t zs_decode(decoder_t *d, char *buf, size_t cap) {
+    zs_state_t *zs = d->state;
+    ZSTD_outBuffer out = {buf, cap, 0};
+    while (out.pos == 0) {
+        if (zs->input.pos == zs->input.size) {
+            zs->input.size = fread(zs->in, 1, sizeof(zs->in), d->fp);
+            zs->input.pos = 0;
+            if (zs->input.size == 0) break;
+        }
+        size_t ret = ZSTD_decompressStream(zs->dctx, &out, &zs->input);
+        if (ZSTD_isError(ret)) return -1;
+    }
+    return out.pos;
+}
+
+static int zs_restart(decoder_t *d, off_t pos) {
+    zs_state_t *zs = d->state;
+    off_t cstart = 0, dstart = 0;
+    if (zs->nb_frames) {
+        // Last frame starting at or before pos
+        size_t lo = 0, hi = zs->nb_frames;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (zs->dstart[mid] <= pos) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        cstart = zs->cstart[lo];
+        dstart = zs->dstart[lo];
+    }
+    // Already in the right frame (or no table): keep decoding forward
+    if (pos >= d->pos && dstart <= d->pos) return 0;
+    if (fseeko(d->fp, cstart, SEEK_SET) != 0) return -1;
+    ZSTD_DCtx_reset(zs->dctx, ZSTD_reset_session_only);
+    zs->input.pos = zs->input.size = 0;
+    d->pos = dstart;
+    return 0;
+}
+
+static void zs_close(decoder_t *d) {
+    zs_state_t *zs = d->state;
+    ZSTD_freeDCtx(zs->dctx);
+    free(zs->cstart);
+    free(zs->dstart);
+    free(zs);
+}
+
+/* Seek table: skippable frame at the end of the file:
+ *   [magic][size] [entries: csize, dsize, (checksum)] [nb_frames][desc][magic]
+ */
+static void zs_read_seek_table(decoder_t *d, zs_state_t *zs) {
+    unsigned char footer[9];
+    if (fseeko(d->fp, 0, SEEK_END) != 0) return;
+    off_t file_size = ftello(d->fp);
+    if (file_size < (off_t)sizeof(footer) ||
+        fseeko(d->fp, -(off_t)sizeof(footer), SEEK_END) != 0 ||
+        fread(footer, 1, sizeof(footer), d->fp) != sizeof(footer) ||
+        rd32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+        return;
+    }
+    size_t nb_frames = rd32(footer);
+    size_t entry_size = (footer[4] & 0x80) ? 12 : 8;  // With checksums
+    off_t table_size = nb_frames * entry_size + sizeof(footer);
+    unsigned char header[8];
+    if (table_size + 8 > file_size ||  // Corrupt frame count
+        fseeko(d->fp, -(table_size + 8), SEEK_END) != 0 ||
+        fread(header, 1, sizeof(header), d->fp) != sizeof(header) ||
+        rd32(header) != ZSTD_SEEK_TABLE_MAGIC ||
+        rd32(header + 4) != table_size) {
+        return;
+    }
+
+    zs->cstart = malloc((nb_frames + 1) * sizeof(off_t));
+    zs->dstart = malloc((nb_frames + 1) * sizeof(off_t));
+    if (zs->cstart == NULL || zs->dstart == NULL) {
+        free(zs->cstart);
+        free(zs->dstart);
+        zs->cstart = zs->dstart = NULL;
+        return;
+    }
+    zs->cstart[0] = zs->dstart[0] = 0;
+    for (size_t f = 0; f < nb_frames; f++) {
+        unsigned char entry[12];
+        if (fread(entry, 1, entry_size, d->fp) != entry_size) {
+            free(zs->cstart);
+            free(zs->dstart);
+            zs->cstart = zs->dstart = NULL;
+            return;
+        }
+        zs->cstart[f + 1] = zs->cstart[f] + rd32(entry);
+        zs->dstart[f + 1] = zs->dstart[f] + rd32(entry + 4);
+    }
+    zs->nb_frames = nb_frames;
+    d->size = zs->dstart[nb_frames];
+}
+
+static int zs_init(decoder_t *d) {
+    zs_state_t *zs = calloc(1, sizeof(zs_state_t));
+    if (zs == NULL || (zs->dctx = ZSTD_createDCtx()) == NULL) {
+        free(zs);
+        return -1;
+    }
+    zs->input.src = zs->in;
+    d->state = zs;
+    d->decode = zs_decode;
+    d->restart = zs_restart;
+    d->close = zs_close;
+    zs_read_seek_table(d, zs);
+    return fseeko(d->fp, 0, SEEK_SET);
+}
+#endif
+
+/* Decoding thread feeding a stdio stream */
+
+typedef struct block {
+    char *data;
+    size_t len;
+} block_t;
+
+typedef struct pipe {
+    decoder_t dec;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signaled on any change */
+    block_t blocks[NB_BLOCKS];
+    size_t head;   /* Next block to read */
+    size_t count;  /* Number of filled blocks */
+    size_t offset; /* Read offset in the head block */
+    bool done;     /* Decoder reached the end of the stream */
+    bool error;    /* Decoder failed */
+    bool stop;     /* Ask the decoding thread to exit */
+    off_t pos;     /* Decompressed offset seen by the reader */
+} pipe_t;
+
+static void *pipe_decode(void *arg) {
+    pipe_t *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        if (p->count == NB_BLOCKS) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        // The reader never touches blocks past head + count
+        block_t *b = &p->blocks[(p->head + p->count) % NB_BLOCKS];
+        pthread_mutex_unlock(&p->lock);
+        ssize_t n = decoder_fill(&p->dec, b->data, BLOCK_SIZE);
+        pthread_mutex_lock(&p->lock);
+        if (n > 0) {
+            b->len = n;
+            p->count++;
+        }
+        if (n < BLOCK_SIZE) {
+            p->done = true;
+            p->error = n < 0;
+        }
+        pthread_cond_broadcast(&p->cond);
+        if (p->done) break;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void pipe_start(pipe_t *p) {
+    p->head = p->count = p->offset = 0;
+    p->done = p->error = p->stop = false;
+    pthread_create(&p->thread, NULL, pipe_decode, p);
+}
+
+static void pipe_stop(pipe_t *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+}
+
+static ssize_t pipe_read(void *cookie, char *buf, size_t size) {
+    pipe_t *p = cookie;
+    size_t n = 0;
+    pthread_mutex_lock(&p->lock);
+    while (n < size) {
+        if (p->count == 0) {
+            if (p->done || n) break;  // Return what we have
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        block_t *b = &p->blocks[p->head];
+        size_t len = MIN(b->len - p->offset, size - n);
+        memcpy(buf + n, b->data + p->offset, len);
+        p->offset += len;
+        n += len;
+        if (p->offset == b->len) {  // Give the block back
+            p->head = (p->head + 1) % NB_BLOCKS;
+            p->count--;
+            p->offset = 0;
+            pthread_cond_broadcast(&p->cond);
+        }
+    }
+    bool error = p->error && p->count == 0;
+    pthread_mutex_unlock(&p->lock);
+    p->pos += n;
+    return (n == 0 && error) ? -1 : (ssize_t)n;
+}
+
+/* Seek inside the decoded blocks, without restarting the decoder */
+static int pipe_skip(pipe_t *p, off_t target) {
+    int ret = -1;
+    pthread_mutex_lock(&p->lock);
+    off_t base = p->pos - p->offset;  // Start of the head block
+    if (target >= base) {
+        size_t rel = target - base;
+        size_t head = p->head, count = p->count;
+        while (count && rel >= p->blocks[head].len) {
+            rel -= p->blocks[head].len;
+            head = (head + 1) % NB_BLOCKS;
+            count--;
+        }
+        if (count) {
+            p->head = head;
+            p->count = count;
+            p->offset = rel;
+            p->pos = target;
+            pthread_cond_broadcast(&p->cond);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int pipe_seek(void *cookie, off64_t *offset, int whence) {
+    pipe_t *p = cookie;
+    off_t target;
+    switch (whence) {
+        case SEEK_SET:
+            target = *offset;
+            break;
+        case SEEK_CUR:
+            target = p->pos + *offset;
+            break;
+        case SEEK_END:
+            if (p->dec.size < 0) return -1;
+            target = p->dec.size + *offset;
+            break;
+        default:
+            return -1;
+    }
+    if (target < 0) return -1;
+    if (target != p->pos && pipe_skip(p, target) != 0) {
+        pipe_stop(p);
+        int ret = decoder_seek(&p->dec, target);
+        p->pos = p->dec.pos;
+        pipe_start(p);
+        if (ret != 0) return -1;
+    }
+    *offset = target;
+    return 0;
+}
+
+static int pipe_close(void *cookie) {
+    pipe_t *p = cookie;
+    pipe_stop(p);
+    for (size_t i = 0; i < NB_BLOCKS; i++) free(p->blocks[i].data);
+    p->dec.close(&p->dec);
+    fclose(p->dec.fp);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+    return 0;
+}
+
+static FILE *pipe_open(FILE *fp, int (*init)(decoder_t *d)) {
+    pipe_t *p = calloc(1, sizeof(pipe_t));
+    if (p == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    p->dec.fp = fp;
+    p->dec.size = -1;
+    if (init(&p->dec) != 0) {
+        free(p);
+        fclose(fp);
+        return NULL;
+    }
+    bool allocated = true;
+    for (size_t i = 0; i < NB_BLOCKS; i++) {
+        p->blocks[i].data = malloc(BLOCK_SIZE);
+        allocated &= p->blocks[i].data != NULL;
+    }
+    if (!allocated) {
+        for (size_t i = 0; i < NB_BLOCKS; i++) free(p->blocks[i].data);
+        p->dec.close(&p->dec);
+        free(p);
+        fclose(fp);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pipe_start(p);
+
+    cookie_io_functions_t io = {.read = pipe_read,
+                                .write = NULL,
+                                .seek = pipe_seek,
+                                .close = pipe_close};
+    FILE *f = fopencookie(p, "r", io);
+    if (f == NULL) {
+        pipe_close(p);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, INPUT_SIZE);
+    return f;
+}
+
+FILE *trace_open(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) return NULL;
+
+    unsigned char magic[4] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    rewind(fp);
+
+    if (n >= 2 && (magic[0] | magic[1] << 8) == GZIP_MAGIC) {
+        return pipe_open(fp, gz_init);
+    }
+    if (n == 4 && rd32(magic) == ZSTD_MAGIC) {
+#ifdef HAVE_ZSTD
+        return pipe_open(fp, zs_init);
+#else
+        fprintf(stderr, "%s: zstd support not compiled in\n", filename);
+        fclose(fp);
+        return NULL;
+#endif
+    }
+    return fp;  // Plain text
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+
+/* Open a trace for reading: plain, gzip or zstd (detected by magic number).
+ * Compressed traces are decoded on a separate thread. The returned stream
+ * supports fseeko()/ftello() in decompressed offsets; zstd traces written
+ * with a seek table (seekable format) seek without decoding from the start.
+ */
+FILE *trace_open(char *filename);
@@ -5,14 +5,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "export.h"
+#include "palette.h"
 #include "parser.h"
+#include "slice.h"
 
 char *render_data[1024];
 uint64_t render_size;
 
-void HSLToRGB(float H, float S, float L, float rgb[]);
-
 int render_init(char *filename) {
     FILE *fp;
     char *line = NULL;
@@ -40,11 +43,9 @@ char *render_line(uint64_t index) {
     return "";
 }
 
-float color_saturation = 0.4;
-float color_lightness = 0.4;
 // Color
-const unsigned int offset = 16 + 1;  // 0 reserved + 16 reserved
-const unsigned int nb_color = 100;   // Palette size
+const unsigned int offset = 16 + 1;          // 0 reserved + 16 reserved
+const unsigned int nb_color = PALETTE_SIZE;  // Palette size
 
 void palette_init() {
     // Fill [1:16] with DEFAULT_COLOR/BLACK
@@ -57,8 +58,7 @@ void palette_init() {
         size_t dark_offset = offset + (dark * nb_color);
         for (size_t c = 0; c < nb_color; c++) {  // Palette size
             size_t ci = c + dark_offset;         // Curses index
-            float coef = (float)c / nb_color;
-            HSLToRGB(coef, color_saturation, color_lightness / (dark + 1), rgb);
+            palette_rgb(c, dark, rgb);
             init_color(ci, rgb[0] * 1000, rgb[1] * 1000, rgb[2] * 1000);
             init_pair(ci, COLOR_WHITE, ci);
         }
@@ -84,79 +84,321 @@ bool inst_char_display(char c, size_t base_time, size_t printtime,
     return true;
 }
 
-void inst_display(inst_t *inst, size_t base_time, size_t cur_time, size_t winw,
-                  size_t draww) {
-    char stage = 'X';
-    unsigned int stage_color = 1;
-
-    size_t delta_time = 0;
+unsigned int stage_get_pair(char *stage, bool dark) {
+    return palette_get_pair(palette_stage_coef(stage), dark);
+}
 
+void inst_display(inst_t *inst, size_t base_time, size_t cur_time, size_t winw,
+                  size_t draww, bool selected) {
     size_t printcount = 0;
     size_t printtime = base_time;
 
-    // Allign to base time
-    for (; printtime < inst->start_time; printcount++, printtime++) {
-        inst_char_display(' ', base_time, printtime, cur_time, printcount,
+    for (; printcount < draww; printcount++, printtime++) {
+        inst_cell_t cell = inst_cell(inst, printtime);
+        unsigned int stage_color = 7;
+        if (cell.stage) {
+            stage_color = stage_get_pair(cell.stage, inst->flushed);
+        } else if (cell.c != ' ') {
+            stage_color = 1;
+        }
+        attron(COLOR_PAIR((stage_color)));
+        // Several lanes busy at once
+        if (cell.nb_active > 1) attron(A_UNDERLINE);
+        inst_char_display(cell.c, base_time, printtime, cur_time, printcount,
                           draww);
+        if (cell.nb_active > 1) attroff(A_UNDERLINE);
+    }
+
+    attron(COLOR_PAIR(7));
+    printw(" ");
+    if (selected) attron(A_REVERSE);  // Cursor row
+    printw("%20s", inst->text_display);
+    if (selected) attroff(A_REVERSE);
+    printw("                                       ");
+}
+
+/* Describe the cursor cell: every lane, its stage and the labels */
+void inspect_display(WINDOW *win, db_t *db, size_t index, size_t cur_time) {
+    int h, w;
+    getmaxyx(win, h, w);
+    werase(win);
+    box(win, 0, 0);
+    int y = 1;
+    mvwprintw(win, y++, 1, "I(%ld) C(%ld)", index, cur_time);
+    if (index >= db->nb_inst || !db->insts[index].valid) {
+        mvwprintw(win, y++, 1, "No instruction");
+        return;
+    }
+    inst_t *inst = &db->insts[index];
+    mvwprintw(win, y++, 1, "%.*s", w - 2, inst->text_display);
+    mvwprintw(win, y++, 1, "[%ld:%ld] %ld cycles%s%s", inst->start_time,
+              inst->end_time, inst->end_time - inst->start_time,
+              inst->flushed ? " flushed" : "",
+              inst->retired ? "" : " not retired");
+    y++;
+
+    for (size_t l = 0; l < inst->nb_lanes && y < h - 1; l++) {
+        inst_lane_t *lane = &inst->lanes[l];
+        inst_interval_t *it = inst_lane_find(lane, cur_time);
+        if (it && cur_time < it->end) {
+            wattron(win, COLOR_PAIR(stage_get_pair(it->stage, inst->flushed)));
+            mvwprintw(win, y++, 1, "lane %ld: %s", lane->id, it->stage);
+            wattroff(win,
+                     COLOR_PAIR(stage_get_pair(it->stage, inst->flushed)));
+            wprintw(win, " [%ld:%ld] %ld/%ld", it->start, it->end,
+                    cur_time - it->start + 1, it->end - it->start);
+        } else {
+            mvwprintw(win, y++, 1, "lane %ld: -", lane->id);
+        }
     }
+    y++;
 
-    for (size_t i = 0; i < inst->nb_states; i++) {
+    // Labels already emitted at the cursor time
+    for (size_t i = 0; i < inst->nb_states && y < h - 1; i++) {
         inst_state_t *s = &inst->states[i];
+        if (s->iser != 'L' || s->time > cur_time) continue;
+        mvwprintw(win, y++, 1, "%ld: %.*s", s->time, w - 12, s->text);
+    }
+}
+
+#define FRAME_MS 16 /* Minimum delay between two frames (~60 fps) */
+
+/* What is displayed: instructions from top, cursor on (cur, cur_time) */
+typedef struct view {
+    size_t top;      /* First displayed instruction */
+    size_t cur;      /* Cursor instruction, displayed */
+    size_t cur_time; /* Cursor cycle */
+    size_t shift;    /* Cycles hidden after the start of top */
+    size_t page;     /* Number of displayed instructions */
+    size_t draww;    /* Number of displayed cycles */
+} view_t;
+
+size_t view_base_time(view_t *v, db_t *db) {
+    size_t start = v->top < db->nb_inst ? db->insts[v->top].start_time : 0;
+    return start + v->shift;
+}
+
+/* Keep the cursor inside the displayed cycles */
+void view_clamp(view_t *v, db_t *db) {
+    size_t base_time = view_base_time(v, db);
+    if (v->cur_time < base_time) v->cur_time = base_time;
+    if (v->cur_time > base_time + v->draww - 1) {
+        v->cur_time = base_time + v->draww - 1;
+    }
+}
+
+/* Move top and the cursor row with it, keeping a full page of
+ * instructions when possible */
+void view_scroll(view_t *v, db_t *db, long delta) {
+    size_t last = db->nb_inst > v->page ? db->nb_inst - v->page : 0;
+    size_t row = v->cur - v->top;
+    if (delta < 0 && (size_t)-delta > v->top) {
+        v->top = 0;
+    } else {
+        v->top += delta;
+    }
+    if (v->top > last) v->top = last;
+    v->cur = v->top + row;
+    if (v->cur >= db->nb_inst) v->cur = db->nb_inst ? db->nb_inst - 1 : 0;
+    v->shift = 0;
+}
+
+/* Move the cursor row, scrolling when it leaves the page */
+void view_move(view_t *v, db_t *db, long delta) {
+    if (delta < 0 && (size_t)-delta > v->cur) {
+        v->cur = 0;
+    } else {
+        v->cur += delta;
+    }
+    if (v->cur >= db->nb_inst) v->cur = db->nb_inst ? db->nb_inst - 1 : 0;
+    size_t top = v->top;
+    if (v->cur < top) top = v->cur;
+    if (v->cur >= top + v->page) top = v->cur - v->page + 1;
+    if (top != v->top) {
+        v->top = top;
+        v->shift = 0;
+    }
+}
+
+/* Cursor on instruction `id`, shown at the top when possible */
+void view_goto(view_t *v, db_t *db, size_t id) {
+    v->cur = v->top;
+    view_scroll(v, db, (long)id - (long)v->top);
+    v->cur = id;
+    view_move(v, db, 0);
+}
+
+/* Show the instructions in flight at `time`, the cursor on it */
+void view_goto_time(view_t *v, db_t *db, size_t time) {
+    size_t top = db_find_alive(db, time);
+    if (top < db->nb_inst) {
+        size_t start = db->insts[top].start_time;
+        // In flight for too long, align on the last one started instead
+        if (time >= start && time - start >= v->draww) {
+            top = db_find_time(db, time);
+        }
+    }
+    view_goto(v, db, top);
+
+    // Nothing started in the displayed cycles: scroll them to the cursor
+    size_t base_time = view_base_time(v, db);
+    if (time >= base_time + v->draww) {
+        v->shift = time - base_time - v->draww / 2;
+    }
+    v->cur_time = time;
+}
+
+/* Read a number on the footer line, false if cancelled */
+bool prompt_number(int row, char *msg, size_t *value) {
+    char buffer[32];
+    attron(COLOR_PAIR(palette_get_pair(75, 0)));
+    mvprintw(row, 0, "%s", msg);
+    clrtoeol();
+    timeout(-1);
+    echo();
+    int ret = getnstr(buffer, sizeof(buffer) - 1);
+    noecho();
+    timeout(0);  // Back to draining keys
+    char *end;
+    *value = strtoull(buffer, &end, 0);
+    return ret == OK && end != buffer;
+}
+
+/* Apply one key to the view. Return false to quit. */
+bool view_key(view_t *v, db_t *db, int ch, int row) {
+    size_t value;
+    switch (ch) {
+        case KEY_LEFT:
+            if (v->cur_time == view_base_time(v, db) && v->shift) v->shift--;
+            if (v->cur_time > view_base_time(v, db)) v->cur_time--;
+            break;
+        case KEY_RIGHT:
+            v->cur_time++;
+            break;
+        case KEY_UP:
+            view_move(v, db, -1);
+            break;
+        case KEY_DOWN:
+            view_move(v, db, 1);
+            break;
+        case KEY_PPAGE:
+            view_scroll(v, db, -(long)v->page);
+            break;
+        case KEY_NPAGE:
+        case ' ':
+            view_scroll(v, db, v->page);
+            break;
+        case KEY_HOME:
+            view_goto(v, db, 0);
+            break;
+        case KEY_END:
+            view_goto(v, db, db->nb_inst);
+            break;
+        case 'g':
+            if (prompt_number(row, "Goto instruction: ", &value)) {
+                view_goto(v, db, value);
+            }
+            break;
+        case 'c':
+            if (prompt_number(row, "Goto cycle: ", &value)) {
+                view_goto_time(v, db, value);
+            }
+            break;
+        case 'q':
+        case KEY_F(2):
+            return false;
+    }
+    view_clamp(v, db);
+    return true;
+}
 
-        if (s->iser == 'R') break;
+long elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+void usage(char *name) {
+    fprintf(stderr,
+            "Usage: %s [-e html|svg|ansi | -s] "
+            "[-i FIRST:LAST | -c FIRST:LAST] [-o OUT] [-r] <FILE>\n"
+            "  -e  Export instead of the interactive view\n"
+            "  -s  Extract a sub-trace instead of the interactive view\n"
+            "  -i  Instructions [FIRST:LAST[ (default: all)\n"
+            "  -c  Instructions alive during the cycles [FIRST:LAST[\n"
+            "  -o  Write to OUT (default: stdout)\n"
+            "  -r  Retire the instructions left without R (truncated trace)\n",
+            name);
+    exit(1);
+}
 
-        switch (s->iser) {
-            case 'I':
-                stage = 'X';  // Error
+int main(int argc, char *argv[]) {
+    bool export = false;
+    bool slice = false;
+    bool repair = false;
+    export_format_t format = EXPORT_ANSI;
+    export_range_t range = {false, 0, (size_t)-1};
+    char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:si:c:o:r")) != -1) {
+        switch (opt) {
+            case 'e':
+                export = true;
+                if (export_format_parse(optarg, &format) != 0) usage(argv[0]);
                 break;
-            case 'S': {               // Start
-                stage = s->stage[0];  // First stage char
-                int32_t hash = 5381;
-                for (char *c = s->stage; *c != '\0'; c++) {
-                    hash += (hash << 5);
-                    hash ^= *c;
-                }
-                stage_color = palette_get_pair(hash % 100, inst->flushed);
+            case 's':
+                slice = true;
                 break;
-            }
-            case 'E':  // End State; stall
-                stage = '.';
+            case 'i':
+            case 'c':
+                range.cycles = opt == 'c';
+                if (sscanf(optarg, "%zu:%zu", &range.first, &range.last) != 2)
+                    usage(argv[0]);
                 break;
-            case 'R':
-                stage = 'X';  // Error
+            case 'o':
+                output = optarg;
                 break;
+            case 'r':
+                repair = true;
+                break;
+            default:
+                usage(argv[0]);
         }
-        attron(COLOR_PAIR((stage_color)));
-        delta_time = inst->states[i + 1].time - inst->states[i].time;
-        // printw("%d ", delta_time);
-        for (size_t j = 0; j < delta_time; j++) {
-            inst_char_display(stage, base_time, printtime, cur_time, printcount,
-                              draww);
-            printcount++;
-            printtime++;
-        }
-        // printw("%08ld: .%c [%s] : %s", s->time, s->iser, s->stage, s->text);
     }
+    if (optind != argc - 1) usage(argv[0]);
+    char *filename = argv[optind];
+    // render_init(filename);
 
-    attron(COLOR_PAIR(7));
-    for (; printcount < draww; printcount++, printtime++) {
-        inst_char_display(' ', base_time, printtime, cur_time, printcount,
-                          draww);
+    FILE *out = stdout;
+    if ((export || slice) && output && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Invalid file: %s\n", output);
+        exit(1);
     }
-    printw(" %20s", inst->text_display);
-    printw("                                       ");
-}
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <FILE>\n", argv[0]);
-        exit(1);
+    // Sub-trace, streamed without building the database
+    if (slice) {
+        if (slice_trace(filename, out, range) != 0) {
+            fprintf(stderr, "Slice failed: empty range or write error\n");
+            exit(1);
+        }
+        fclose(out);
+        return 0;
     }
-    char *filename = argv[1];
-    // render_init(filename);
 
     // Create database
-    db_t *db = parse(filename);
+    db_t *db = parse(filename, repair);
+
+    // Headless export
+    if (export) {
+        if (export_db(db, out, format, range) != 0) {
+            fprintf(stderr, "Export failed: empty range or write error\n");
+            exit(1);
+        }
+        fclose(out);
+        return 0;
+    }
 
     // ncurses init
     initscr();                  /* start the curses mode    */
@@ -165,13 +407,12 @@ int main(int argc, char *argv[]) {
     assert(has_colors());       /* For now assert colors    */
     assert(can_change_color()); /* ^                        */
     palette_init();             /* Initiate my palette      */
-    // cbreak();
-    // nodelay(stdscr, TRUE); /* No delaying */
+    cbreak();                   /* Keys without line buffer */
+    noecho();                   /* Don't print keys         */
     // init_pair(1, COLOR_WHITE, COLOR_BLACK);
     // init_pair(2, COLOR_BLACK, COLOR_CYAN);
-    int x = 0, y = 0;  // Cursor position;
-    int row, col;      /* to store the number of rows and *
-                        * the number of colums of the screen */
+    int row, col; /* to store the number of rows and *
+                   * the number of colums of the screen */
 
     getmaxyx(stdscr, row, col); /* get the number of rows and columns */
     WINDOW *win = newwin(20, 20, 20, 20);
@@ -182,12 +423,14 @@ int main(int argc, char *argv[]) {
     uint16_t scr_header_offset = 1;
     uint16_t scr_footer_offset = 1;
 
-    int ch;
+    int ch = 0;
+    size_t nb_keys = 0;  // Keys coalesced in the last frame
 
-    size_t cur_inst = 0;
-    size_t cur_time = 0;
+    view_t view = {0, 0, 0, 0, 1, 1};
+    struct timespec frame_start;
 
-    while ((ch = getch()) != KEY_F(2)) {
+    for (bool run = true; run;) {
+        clock_gettime(CLOCK_MONOTONIC, &frame_start);
         getmaxyx(stdscr, row, col); /* get the number of rows and columns */
         // Split screen in 2:
         // Update sizes
@@ -197,85 +440,46 @@ int main(int argc, char *argv[]) {
 
         wresize(win, win_height, col - scr_split);
         mvwin(win, scr_footer_offset, scr_split);
-        box(win, 0, 0); /* 0, 0 gives default characters  */
 
-        // Gey input
-        switch (ch) {
-            case KEY_LEFT:
-                x--;
-                cur_time--;
-                break;
-
-            case KEY_RIGHT:
-                x++;
-                cur_time++;
-                break;
-
-            case KEY_UP:
-                y++;
-                break;
-            case KEY_DOWN:
-                y--;
-                break;
-            case ' ':
-                y -= col;
-                break;
-        }
+        view.page = row > 2 ? row - 2 : 1;
+        view.draww = scr_split * 3 / 4 ? scr_split * 3 / 4 : 1;
+        view_move(&view, db, 0);  // Cursor row still inside the page
+        view_clamp(&view, db);
 
         // Header
         attron(COLOR_PAIR(palette_get_pair(75, 0)));
         mvprintw(0, 0, "Konata-ncurses");
         printw(" --- %s ---", db->filename);
-        printw(" I(%ld / %ld)", cur_inst, db->nb_inst);
-        printw(" C(%ld / [%ld:%ld])", cur_time, db->start_time, db->end_time);
+        printw(" I(%ld / %ld)", view.cur, db->nb_inst);
+        printw(" C(%ld / [%ld:%ld])", view.cur_time, db->start_time,
+               db->end_time);
         for (int i = 0; i < col; i++) {
             printw(" ");
         }
 
         // Data
-
-        size_t draww = scr_split * 3 / 4;
-
-        size_t init_row = 1, init_index = -y;
-        size_t base_time;
-        if (init_index >= db->nb_inst) {
-            base_time = 0;
-        } else {
-            base_time = db->insts[init_index].start_time;
-        }
-        if (cur_time < base_time) {
-            cur_time = base_time;
-        }
-        if (cur_time > base_time + draww - 1) {
-            cur_time = base_time + draww - 1;
-        }
-        // cur_time = base_time + 10;
-        cur_inst = init_index;
-        for (size_t i = init_row, index = init_index; i < row - 1;
+        size_t base_time = view_base_time(&view, db);
+        for (size_t i = 1, index = view.top; i < (size_t)row - 1;
              i++, index++) {
             move(i, 0);
             if (index >= db->nb_inst) {  // Display blanck line
                 attron(COLOR_PAIR(1));
                 for (size_t c = 0; c <= scr_split / 8; c++) printw(".        ");
             } else {
-                inst_display(&db->insts[index], base_time, cur_time, scr_split,
-                             draww);
+                inst_display(&db->insts[index], base_time, view.cur_time,
+                             scr_split, view.draww, index == view.cur);
             }
-            /*char *str = render_line(i - y);
-            for (int j = 0; j < col && *str != '\0'; j++) {
-                attron(COLOR_PAIR(color++ % 256));
-                printw("%c", *str);
-                str++;
-            }*/
-            // mvprintw(i, 0, render_line(i-y));
         }
 
+        inspect_display(win, db, view.cur, view.cur_time);
+
         // Bottom
         attron(COLOR_PAIR(palette_get_pair(75, 0)));
-        mvprintw(row - 1, 0, "This screen has %d rows and %d columns (%d, %d) ",
-                 row, col, y, x);
-        printw("COLORS = %d, COLOR_PAIRS = %d\n", COLORS, COLOR_PAIRS);
-        printw("CH=%x", ch);
+        mvprintw(row - 1, 0, "This screen has %d rows and %d columns ", row,
+                 col);
+        printw("COLORS = %d, COLOR_PAIRS = %d ", COLORS, COLOR_PAIRS);
+        printw("CH=%x (%ld) ", ch, nb_keys);
+        printw("[PgUp/PgDn Home/End g:inst c:cycle q:quit]");
         for (int i = 0; i < col; i++) {
             printw(" ");
         }
@@ -285,6 +489,22 @@ int main(int argc, char *argv[]) {
         wnoutrefresh(stdscr);
         wnoutrefresh(win); /* Show that box 		*/
         doupdate();
+
+        // Wait for a key, let the others arrive until the frame budget is
+        // spent, then apply them all before the next repaint
+        timeout(-1);
+        ch = getch();
+        long wait = FRAME_MS - elapsed_ms(&frame_start);
+        if (wait > 0) napms(wait);
+        timeout(0);
+        for (int next = ch, n = 0; next != ERR; next = getch(), n++) {
+            ch = next;
+            nb_keys = n + 1;
+            if (!view_key(&view, db, ch, row - 1)) {
+                run = false;
+                break;
+            }
+        }
     }
     endwin();
 
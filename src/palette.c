@@ -1,3 +1,10 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "palette.h"
+
+float color_saturation = 0.4;
+float color_lightness = 0.4;
 
 static void hueToRgb(float *c, float p, float q, float t) {
     // Clip
@@ -29,3 +36,19 @@ void HSLToRGB(float H, float S, float L, float rgb[]) {
     }
 }
 
+
+/* Color of a palette entry, darker for flushed instructions */
+void palette_rgb(unsigned int coef100, bool dark, float rgb[]) {
+    float coef = (float)coef100 / PALETTE_SIZE;
+    HSLToRGB(coef, color_saturation, color_lightness / (dark + 1), rgb);
+}
+
+/* Palette entry of a stage, from its name */
+unsigned int palette_stage_coef(char *stage) {
+    uint32_t hash = 5381;
+    for (char *c = stage; *c != '\0'; c++) {
+        hash += (hash << 5);
+        hash ^= *c;
+    }
+    return hash % PALETTE_SIZE;
+}
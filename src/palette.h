@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define PALETTE_SIZE 100
+
+void HSLToRGB(float H, float S, float L, float rgb[]);
+void palette_rgb(unsigned int coef100, bool dark, float rgb[]);
+unsigned int palette_stage_coef(char *stage);
@@ -5,8 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "input.h"
+#include "parser.h"
+
 #define DEBUG_PARSE 0
-#define DEBUG_DUMP 1
+#define DEBUG_DUMP 0
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -58,54 +61,6 @@ char *singleton(char *str) {
     } while (1);
 }
 
-typedef struct cmd_C {
-    unsigned char set;
-    size_t value;
-} cmd_C_t;
-
-typedef struct cmd_I {
-    size_t id;
-    size_t id_sim;
-    size_t id_thread;
-} cmd_I_t;
-
-typedef struct cmd_L {
-    size_t id;
-    uint8_t type;
-    char *str;
-} cmd_L_t;
-
-typedef struct cmd_S {
-    size_t id;
-    size_t id_lane;
-    char *stage;
-} cmd_S_t, cmd_E_t;
-
-typedef struct cmd_R {
-    size_t id;
-    size_t id_retire;
-    uint8_t type;
-} cmd_R_t;
-
-typedef struct cmd_W {
-    size_t id_consumer;
-    size_t id_producer;
-    int type;
-} cmd_W_t;
-
-typedef struct cmd {
-    char id;
-    union {
-        cmd_C_t C;
-        cmd_I_t I;
-        cmd_L_t L;
-        cmd_S_t S;
-        cmd_E_t E;
-        cmd_R_t R;
-        cmd_W_t w;
-    } astype;
-} cmd_t;
-
 // C=   CYCLE
 //
 // C	CYCLE
@@ -174,6 +129,10 @@ void cmd_print(cmd_t *cmd, FILE *f) {
             fprintf(f, "R\t%ld\t%ld\t%d\n", cmd->astype.R.id,
                     cmd->astype.R.id_retire, cmd->astype.R.type);
             break;
+        case 'W':
+            fprintf(f, "W\t%ld\t%ld\t%d\n", cmd->astype.w.id_consumer,
+                    cmd->astype.w.id_producer, cmd->astype.w.type);
+            break;
         default:
             fprintf(stderr, "cmd_print: Invalid cmd ID: %c\n", cmd->id);
             exit(1);
@@ -183,82 +142,73 @@ void cmd_print(cmd_t *cmd, FILE *f) {
 #define FT "%[^\t]"
 #define FN "%[^\n]"
 
+/* Parse one line, return -1 if malformed */
 int cmd_parse(char *line, cmd_t *cmd) {
     char buffer[1024];
     // TODO: dynamic allocation
     if (strlen(line) >= sizeof(buffer)) {
-        fprintf(stderr, "cmd_parse: line too long: %s\n", line);
-        exit(1);
+        return -1;
     }
 
+    int n = 0, expected = 3;
+    buffer[0] = '\0';
     cmd->id = line[0];
     switch (cmd->id) {
         case 'C': {
-            sscanf(line, FT "\t%ld", buffer, &cmd->astype.C.value);
-            if (buffer[1] == '=') {
-                cmd->astype.C.set = 1;
-            }
+            n = sscanf(line, FT "\t%ld", buffer, &cmd->astype.C.value);
+            cmd->astype.C.set = buffer[1] == '=';
+            expected = 2;
             break;
         }
         case 'I': {
-            sscanf(line, "%*c\t%ld\t%ld\t%ld", &cmd->astype.I.id,
-                   &cmd->astype.I.id_sim, &cmd->astype.I.id_thread);
+            n = sscanf(line, "%*c\t%ld\t%ld\t%ld", &cmd->astype.I.id,
+                       &cmd->astype.I.id_sim, &cmd->astype.I.id_thread);
             break;
         }
         case 'L': {
-            sscanf(line, "%*c\t%ld\t%hhd\t" FN, &cmd->astype.L.id,
-                   &cmd->astype.L.type, buffer);
-            cmd->astype.L.str = salloc(buffer);
+            n = sscanf(line, "%*c\t%ld\t%hhd\t" FN, &cmd->astype.L.id,
+                       &cmd->astype.L.type, buffer);
+            expected = 2;  // Empty text
+            if (n >= expected) cmd->astype.L.str = salloc(buffer);
             break;
         }
         case 'S':
         case 'E': {
-            sscanf(line, "%*c\t%ld\t%ld\t" FN, &cmd->astype.S.id,
-                   &cmd->astype.S.id_lane, buffer);
-            cmd->astype.S.stage = singleton(buffer);
+            n = sscanf(line, "%*c\t%ld\t%ld\t" FN, &cmd->astype.S.id,
+                       &cmd->astype.S.id_lane, buffer);
+            if (n >= expected) cmd->astype.S.stage = singleton(buffer);
             break;
         }
         case 'R': {
-            sscanf(line, "%*c\t%ld\t%ld\t%hhd", &cmd->astype.R.id,
-                   &cmd->astype.R.id_retire, &cmd->astype.R.type);
+            n = sscanf(line, "%*c\t%ld\t%ld\t%hhd", &cmd->astype.R.id,
+                       &cmd->astype.R.id_retire, &cmd->astype.R.type);
+            break;
+        }
+        case 'W': {
+            n = sscanf(line, "%*c\t%ld\t%ld\t%d",
+                       &cmd->astype.w.id_consumer, &cmd->astype.w.id_producer,
+                       &cmd->astype.w.type);
             break;
         }
-        default:
-            fprintf(stderr, "cmd_parse: Invalid cmd ID: %c\n", cmd->id);
-            exit(1);
     }
-    return 0;
+    return n >= expected ? 0 : -1;
 }
 
 cmd_t *cmd_parse_file(char *filename, size_t *size) {
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
-    FILE *fp = fopen(filename, "r");
+    FILE *fp = trace_open(filename);
 
     if (fp == NULL) {
         fprintf(stderr, "Invalid file: %s\n", filename);
         exit(1);
     }
 
-    /* First pass: count lines: */
-    {
-        char buf[65536];  // Stack buffer
-        int counter = 0;
-        for (;;) {
-            size_t res = fread(buf, 1, sizeof(buf), fp);
-            for (size_t i = 0; i < res; i++)
-                if (buf[i] == '\n') counter++;
-            if (feof(fp)) break;
-        }
-        rewind(fp);
-        *size = counter - 1;
-    }
-
-    // Allocate data
-    cmd_t *cmds = malloc(*size * sizeof(cmd_t));
+    // Allocate data, grown while parsing: compressed input can't be rewound
+    size_t capacity = 1 << 16;
+    cmd_t *cmds = malloc(capacity * sizeof(cmd_t));
 
-    /* Second pass: parse data */
     if (getline(&line, &len, fp) == -1) {
         fprintf(stderr, "Missing header file\n");
         exit(1);
@@ -271,12 +221,22 @@ cmd_t *cmd_parse_file(char *filename, size_t *size) {
 
     size_t i = 0;
     while ((read = getline(&line, &len, fp)) != -1) {
+        if (i == capacity) {
+            capacity *= 2;
+            cmds = realloc(cmds, capacity * sizeof(cmd_t));
+            assert(cmds);
+        }
         cmd_t *cmd = &cmds[i];
 
         // printf("%s", line);
-        cmd_parse(line, cmd);
+        if (cmd_parse(line, cmd) != 0) {
+            // Keep a placeholder: record i stays on line i + 2
+            fprintf(stderr, "%s:%ld: invalid record: %.*s\n", filename,
+                    i + 2, (int)strcspn(line, "\n"), line);
+            cmd->id = 0;
+        }
 
-        if (DEBUG_PARSE) {
+        if (DEBUG_PARSE && cmd->id) {
             char *buffer_debug = malloc(len);
             FILE *fpd = fmemopen(buffer_debug, len, "w");
             cmd_print(cmd, fpd);
@@ -295,25 +255,24 @@ cmd_t *cmd_parse_file(char *filename, size_t *size) {
     fclose(fp);
     if (line) free(line);
 
+    *size = i;
     return cmds;
 }
 
 /* Database */
 
-#include "parser.h"
-
 void inst_dump(inst_t *inst) {
     printf("[%ld:%ld] %20s:\n", inst->start_time, inst->end_time,
            inst->text_display);
     for (size_t i = 0; i < inst->nb_states; i++) {
         inst_state_t *s = &inst->states[i];
-        printf("---> %08ld: .%c [%s] : %s\n", s->time, s->iser, s->stage,
-               s->text);
+        printf("---> %08ld: .%c %ld [%s] : %s\n", s->time, s->iser, s->lane,
+               s->stage, s->text);
     }
 }
 
-void inst_state_append(inst_t *inst, size_t time, char iser, char *stage,
-                       char *text) {
+void inst_state_append(inst_t *inst, size_t time, char iser, size_t lane,
+                       char *stage, char *text) {
     inst->nb_states += 1;
     inst->states =
         realloc(inst->states, inst->nb_states * sizeof(inst_state_t));
@@ -321,10 +280,149 @@ void inst_state_append(inst_t *inst, size_t time, char iser, char *stage,
 
     s->time = time;
     s->iser = iser;
+    s->lane = lane;
     s->stage = stage;
     s->text = text;
 }
 
+/* Lanes */
+
+#define INTERVAL_OPEN ((size_t)-1)
+
+/* Find or create the lane `id`, lanes are kept sorted by id */
+inst_lane_t *inst_lane_get(inst_t *inst, size_t id) {
+    size_t i = 0;
+    for (; i < inst->nb_lanes && inst->lanes[i].id <= id; i++) {
+        if (inst->lanes[i].id == id) return &inst->lanes[i];
+    }
+    inst->nb_lanes += 1;
+    inst->lanes = realloc(inst->lanes, inst->nb_lanes * sizeof(inst_lane_t));
+    memmove(&inst->lanes[i + 1], &inst->lanes[i],
+            (inst->nb_lanes - 1 - i) * sizeof(inst_lane_t));
+    inst_lane_t *lane = &inst->lanes[i];
+    lane->id = id;
+    lane->intervals = NULL;
+    lane->nb_intervals = 0;
+    return lane;
+}
+
+/* Close the current stage of a lane, if any */
+void inst_lane_close(inst_lane_t *lane, size_t time) {
+    if (lane->nb_intervals == 0) return;
+    inst_interval_t *last = &lane->intervals[lane->nb_intervals - 1];
+    if (last->end == INTERVAL_OPEN) last->end = time;
+}
+
+void inst_lane_open(inst_lane_t *lane, size_t time, char *stage) {
+    // A new stage implicitly ends the previous one: E can be omitted
+    inst_lane_close(lane, time);
+    lane->nb_intervals += 1;
+    lane->intervals = realloc(lane->intervals,
+                              lane->nb_intervals * sizeof(inst_interval_t));
+    inst_interval_t *it = &lane->intervals[lane->nb_intervals - 1];
+    it->start = time;
+    it->end = INTERVAL_OPEN;
+    it->stage = stage;
+}
+
+/* Convert the linear states into per lane intervals. States are appended in
+ * time order so intervals come out sorted by start time. */
+void inst_build_lanes(inst_t *inst) {
+    for (size_t i = 0; i < inst->nb_states; i++) {
+        inst_state_t *s = &inst->states[i];
+        switch (s->iser) {
+            case 'S':
+                inst_lane_open(inst_lane_get(inst, s->lane), s->time, s->stage);
+                break;
+            case 'E':
+                inst_lane_close(inst_lane_get(inst, s->lane), s->time);
+                break;
+            case 'R':
+                for (size_t l = 0; l < inst->nb_lanes; l++)
+                    inst_lane_close(&inst->lanes[l], s->time);
+                break;
+        }
+    }
+    // Unretired instruction (truncated trace): close at its end time
+    for (size_t l = 0; l < inst->nb_lanes; l++)
+        inst_lane_close(&inst->lanes[l], inst->end_time);
+}
+
+/* Last interval of the lane starting at or before `time`, NULL if none.
+ * The interval is active if time < end. */
+inst_interval_t *inst_lane_find(inst_lane_t *lane, size_t time) {
+    size_t lo = 0, hi = lane->nb_intervals;  // Search in [lo:hi[
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lane->intervals[mid].start <= time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &lane->intervals[lo - 1] : NULL;
+}
+
+/* Last instruction started at or before `time`. Instructions are issued
+ * in id order, so start times are sorted. */
+size_t db_find_time(db_t *db, size_t time) {
+    size_t lo = 0, hi = db->nb_inst;  // Search in [lo:hi[
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (db->insts[mid].start_time <= time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? lo - 1 : 0;
+}
+
+/* First instruction still running at `time`, or started after it if none.
+ * End times are not sorted, but their prefix max is. Return nb_inst if
+ * every instruction ended at or before `time`. */
+size_t db_find_alive(db_t *db, size_t time) {
+    size_t lo = 0, hi = db->nb_inst;  // Search in [lo:hi[
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (db->max_end[mid] <= time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+inst_cell_t inst_cell(inst_t *inst, size_t time) {
+    inst_cell_t cell = {' ', NULL, 0};
+    if (!inst->valid || time < inst->start_time || time >= inst->end_time) {
+        return cell;
+    }
+
+    inst_interval_t *active = NULL;  // Lowest active lane
+    inst_interval_t *last = NULL;    // Last ended stage, for stalls
+    for (size_t l = 0; l < inst->nb_lanes; l++) {
+        inst_interval_t *it = inst_lane_find(&inst->lanes[l], time);
+        if (it == NULL) continue;
+        if (time < it->end) {
+            cell.nb_active++;
+            if (active == NULL) active = it;
+        } else if (last == NULL || it->end > last->end) {
+            last = it;
+        }
+    }
+
+    if (active) {
+        cell.c = active->stage[0];
+        cell.stage = active->stage;
+    } else {
+        cell.c = '.';
+        cell.stage = last ? last->stage : NULL;
+    }
+    return cell;
+}
+
 db_t *inst_create_database(cmd_t *cmds, size_t size) {
     // First pass: compute idx range
     size_t nb_inst = 0;
@@ -337,7 +435,7 @@ db_t *inst_create_database(cmd_t *cmds, size_t size) {
     // Allocate db and insts
     db_t *db = calloc(sizeof(db_t), 1);
     assert(db);
-    printf("Allocate %ld insts\n", nb_inst);
+    fprintf(stderr, "Allocate %ld insts\n", nb_inst);
     inst_t *inst = calloc(sizeof(inst_t), nb_inst);
     assert(inst);
 
@@ -366,39 +464,56 @@ db_t *inst_create_database(cmd_t *cmds, size_t size) {
                     // assert(inst[cmd->astype.L.id].text_display == NULL);
                     inst[cmd->astype.L.id].text_display = cmd->astype.L.str;
                 } else {
-                    // TODO
+                    inst_state_append(&inst[cmd->astype.L.id], time, 'L', 0,
+                                      " ", cmd->astype.L.str);
                 }
                 break;
             }
             case 'S': {
                 inst_state_append(&inst[cmd->astype.S.id], time, 'S',
-                                  cmd->astype.S.stage, "");
+                                  cmd->astype.S.id_lane, cmd->astype.S.stage,
+                                  "");
                 break;
             }
             case 'E': {
                 inst_state_append(&inst[cmd->astype.E.id], time, 'E',
-                                  cmd->astype.E.stage, "");
+                                  cmd->astype.E.id_lane, cmd->astype.E.stage,
+                                  "");
                 break;
             }
             case 'R': {
-                inst_state_append(&inst[cmd->astype.R.id], time, 'R', " ", "");
+                inst_state_append(&inst[cmd->astype.R.id], time, 'R', 0, " ",
+                                  "");
                 if (cmd->astype.R.type == 1) {
                     inst[cmd->astype.R.id].flushed = 1;
                 }
+                inst[cmd->astype.R.id].retired = 1;
                 inst[cmd->astype.R.id].end_time = time;
                 break;
             }
         }
     }
+
+    // Third pass: per lane stage intervals, and end time lookup
+    size_t *max_end = malloc((nb_inst ? nb_inst : 1) * sizeof(size_t));
+    assert(max_end);
+    for (size_t i = 0; i < nb_inst; i++) {
+        if (!inst[i].retired) inst[i].end_time = time;
+        inst_build_lanes(&inst[i]);
+        max_end[i] = i ? max_end[i - 1] : 0;
+        if (inst[i].valid) max_end[i] = MAX(max_end[i], inst[i].end_time);
+    }
+    db->max_end = max_end;
     db->nb_inst = nb_inst;
     db->insts = inst;
     db->end_time = time;
     return db;
 }
 
-db_t *parse(char *filename) {
+db_t *parse(char *filename, bool repair) {
     size_t size;
     cmd_t *cmds = cmd_parse_file(filename, &size);
+    cmd_validate(filename, &cmds, &size, repair);
 
 #if DEBUG_PARSE
     printf("size = %ld\n", size);
@@ -426,6 +541,6 @@ __attribute__((weak)) int main(int argc, char **argv) {
         exit(1);
     }
     char *filename = argv[1];
-    db_t *db = parse(filename);
+    db_t *db = parse(filename, false);
     (void)db;
 }
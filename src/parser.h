@@ -1,31 +1,119 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
+
+/* Trace commands, one per line */
+
+typedef struct cmd_C {
+    unsigned char set;
+    size_t value;
+} cmd_C_t;
+
+typedef struct cmd_I {
+    size_t id;
+    size_t id_sim;
+    size_t id_thread;
+} cmd_I_t;
+
+typedef struct cmd_L {
+    size_t id;
+    uint8_t type;
+    char *str;
+} cmd_L_t;
+
+typedef struct cmd_S {
+    size_t id;
+    size_t id_lane;
+    char *stage;
+} cmd_S_t, cmd_E_t;
+
+typedef struct cmd_R {
+    size_t id;
+    size_t id_retire;
+    uint8_t type;
+} cmd_R_t;
+
+typedef struct cmd_W {
+    size_t id_consumer;
+    size_t id_producer;
+    int type;
+} cmd_W_t;
+
+typedef struct cmd {
+    char id;
+    union {
+        cmd_C_t C;
+        cmd_I_t I;
+        cmd_L_t L;
+        cmd_S_t S;
+        cmd_E_t E;
+        cmd_R_t R;
+        cmd_W_t w;
+    } astype;
+} cmd_t;
 
 typedef struct inst_state {
     size_t time;
-    char iser;  // Init Stage Endstage Retire
+    char iser;  // Init Stage Endstage Retire Label
+    size_t lane;
     char *stage;
     char *text;
 } inst_state_t;
 
+/* A stage occupied on one lane during [start:end[ cycles */
+typedef struct inst_interval {
+    size_t start;
+    size_t end;
+    char *stage;
+} inst_interval_t;
+
+/* All the stages of one lane, sorted by start time (never overlapping) */
+typedef struct inst_lane {
+    size_t id;
+    inst_interval_t *intervals;
+    size_t nb_intervals;
+} inst_lane_t;
+
 typedef struct inst {
     char valid;
     size_t start_time;
     size_t end_time;
     bool flushed;
+    bool retired;
     char *text_display;
 
     inst_state_t *states;
     size_t nb_states;
+
+    inst_lane_t *lanes; /* Built from states at load time, sorted by id */
+    size_t nb_lanes;
 } inst_t;
 
+/* What to draw for an instruction at a given cycle */
+typedef struct inst_cell {
+    char c;           /* ' ' outside of the instruction, '.' when stalled */
+    char *stage;      /* Stage used for coloring, NULL if none */
+    size_t nb_active; /* Number of lanes active at that cycle */
+} inst_cell_t;
+
 typedef struct db {
     char *filename;     /* DB source filename */
     size_t start_time;  /* Cycles */
     size_t end_time;    /* Cycles */
     size_t nb_inst;     /* Number of instructions */
     inst_t *insts;      /* the instructions sorted by id */
+    size_t *max_end;    /* Largest end_time among insts [0:id] */
 } db_t;
 
-db_t *parse(char *filename);
+int cmd_parse(char *line, cmd_t *cmd);
+void cmd_print(cmd_t *cmd, FILE *f);
+
+size_t cmd_validate(char *filename, cmd_t **cmds, size_t *size, bool repair);
+
+db_t *parse(char *filename, bool repair);
+size_t db_find_time(db_t *db, size_t time);
+size_t db_find_alive(db_t *db, size_t time);
+
+inst_interval_t *inst_lane_find(inst_lane_t *lane, size_t time);
+inst_cell_t inst_cell(inst_t *inst, size_t time);
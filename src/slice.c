@@ -0,0 +1,437 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "input.h"
+#include "parser.h"
+#include "slice.h"
+
+#define INDEX_STEP 4096    /* Instructions between two checkpoints */
+#define INDEX_MAGIC "KIDX0001"
+#define MAX_ID_GAP 65536   /* Missing instruction ids tolerated in a row */
+#define MAX_DIAGNOSTICS 20 /* Printed per kind, the others are counted */
+
+typedef enum warn {
+    WARN_TIME_BACK,
+    WARN_NEGATIVE_STEP,
+    WARN_UNEXPECTED_ID,
+    NB_WARNS,
+} warn_t;
+
+static char *warn_msgs[NB_WARNS] = {
+    [WARN_TIME_BACK] = "time goes back to",
+    [WARN_NEGATIVE_STEP] = "negative cycle step",
+    [WARN_UNEXPECTED_ID] = "unexpected instruction",
+};
+
+/* A place to resume reading the trace */
+typedef struct checkpoint {
+    uint64_t id;          /* Instruction started on that line */
+    uint64_t offset;      /* Offset of its I line */
+    uint64_t time;        /* Cycle at that line */
+    uint64_t live_offset; /* I line of the oldest instruction still alive */
+    uint64_t live_time;   /* Cycle at that line */
+} checkpoint_t;
+
+typedef struct index {
+    uint64_t trace_size; /* To detect an outdated index */
+    uint64_t trace_mtime;
+    uint64_t nb_checkpoints;
+    checkpoint_t *checkpoints;
+} index_t;
+
+/* Trace reader keeping track of offsets and time */
+typedef struct reader {
+    char *filename;
+    FILE *fp;
+    char *line;
+    size_t len;
+    off_t header;  /* Offset of the first command */
+    off_t offset;  /* Offset of the current command */
+    off_t next;    /* Offset of the next command */
+    off_t checked; /* Commands before were already reported */
+    size_t time;   /* Cycle of the current command */
+    bool timed;    /* Some record already got a time */
+    size_t counts[NB_WARNS];
+    cmd_t cmd;     /* Current command */
+} reader_t;
+
+/* Instructions state, for ids in [base:base+size[ */
+typedef struct slot {
+    bool started;
+    bool retired;
+    bool emitted;
+    bool closed; /* R emitted, only labels may follow */
+    off_t offset; /* Offset of the I line */
+    size_t start; /* Cycles */
+    size_t end;
+    size_t new_id; /* Id in the slice */
+} slot_t;
+
+typedef struct window {
+    size_t base;
+    size_t size;
+    size_t capacity;
+    size_t next; /* Id of the next I record, once one is seen */
+    bool started;
+    slot_t *slots;
+} window_t;
+
+/* Reader */
+
+static int reader_open(reader_t *r, char *filename) {
+    memset(r, 0, sizeof(reader_t));
+    r->filename = filename;
+    r->fp = trace_open(filename);
+    if (r->fp == NULL) {
+        fprintf(stderr, "Invalid file: %s\n", filename);
+        return -1;
+    }
+    ssize_t n = getline(&r->line, &r->len, r->fp);
+    if (n == -1 || strcmp("Kanata\t0004\n", r->line) != 0) {
+        fprintf(stderr, "Bad file format: %s\n", filename);
+        return -1;
+    }
+    r->header = r->next = n;
+    return 0;
+}
+
+static void reader_close(reader_t *r) {
+    for (warn_t kind = 0; kind < NB_WARNS; kind++) {
+        if (r->counts[kind] > MAX_DIAGNOSTICS) {
+            fprintf(stderr, "%s: %ld more \"%s\" not shown\n", r->filename,
+                    r->counts[kind] - MAX_DIAGNOSTICS, warn_msgs[kind]);
+        }
+    }
+    if (r->cmd.id == 'L') free(r->cmd.astype.L.str);
+    fclose(r->fp);
+    free(r->line);
+}
+
+static int reader_seek(reader_t *r, off_t offset, size_t time) {
+    if (r->cmd.id == 'L') free(r->cmd.astype.L.str);
+    r->cmd.id = 0;
+    r->next = offset;
+    r->time = time;
+    r->timed = offset != r->header;
+    return fseeko(r->fp, offset, SEEK_SET);
+}
+
+/* Report a skipped record, once even if the trace is read several times */
+static void reader_warn(reader_t *r, warn_t kind, size_t value) {
+    if (r->offset < r->checked) return;
+    if (r->counts[kind]++ >= MAX_DIAGNOSTICS) return;
+    fprintf(stderr, "%s: offset %ld: %c: %s %ld\n", r->filename,
+            (long)r->offset, r->cmd.id, warn_msgs[kind], value);
+}
+
+/* Read and parse the next command, false at the end of the trace. Time
+ * never goes back: the records that would do it are skipped. */
+static bool reader_next(reader_t *r) {
+    if (r->cmd.id == 'L') free(r->cmd.astype.L.str);
+    r->cmd.id = 0;
+    if (r->next > r->checked) r->checked = r->next;
+    ssize_t n = getline(&r->line, &r->len, r->fp);
+    if (n == -1) return false;
+    r->offset = r->next;
+    r->next += n;
+    if (cmd_parse(r->line, &r->cmd) != 0) r->cmd.id = 0;  // Skipped
+    if (r->cmd.id != 'C') {
+        r->timed |= r->cmd.id != 0;
+    } else if (r->cmd.astype.C.set) {
+        if (r->timed && r->cmd.astype.C.value < r->time) {
+            reader_warn(r, WARN_TIME_BACK, r->cmd.astype.C.value);
+            r->cmd.id = 0;
+        } else {
+            r->time = r->cmd.astype.C.value;
+        }
+    } else if ((long)r->cmd.astype.C.value < 0) {
+        reader_warn(r, WARN_NEGATIVE_STEP, r->cmd.astype.C.value);
+        r->cmd.id = 0;
+    } else {
+        r->time += r->cmd.astype.C.value;
+    }
+    return true;
+}
+
+/* Window */
+
+static slot_t *window_find(window_t *w, size_t id) {
+    if (id < w->base || id - w->base >= w->size) return NULL;
+    return &w->slots[id - w->base];
+}
+
+static slot_t *window_push(window_t *w) {
+    if (w->size == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 1024;
+        w->slots = realloc(w->slots, w->capacity * sizeof(slot_t));
+        assert(w->slots);
+    }
+    slot_t *s = &w->slots[w->size++];
+    memset(s, 0, sizeof(slot_t));
+    return s;
+}
+
+/* Add the slot of a new instruction. Ids are sequential, but some may be
+ * missing: their slots are left not started. NULL if `id` goes back or
+ * jumps too far ahead. */
+static slot_t *window_add(window_t *w, size_t id) {
+    if (!w->started) {
+        w->next = id;
+        w->started = true;
+    }
+    if (id < w->next || id - w->next > MAX_ID_GAP) return NULL;
+    if (w->size == 0) w->base = id;
+    while (w->base + w->size < id) window_push(w);
+    w->next = id + 1;
+    return window_push(w);
+}
+
+/* Forget the retired instructions at the start of the window */
+static void window_drop_retired(window_t *w) {
+    size_t n = 0;
+    for (; n < w->size; n++) {
+        if (w->slots[n].started && !w->slots[n].retired) break;
+    }
+    memmove(w->slots, &w->slots[n], (w->size - n) * sizeof(slot_t));
+    w->base += n;
+    w->size -= n;
+}
+
+/* Index */
+
+static void index_path(char *filename, char *path, size_t size) {
+    snprintf(path, size, "%s.kidx", filename);
+}
+
+static int index_load(char *filename, index_t *idx, struct stat *st) {
+    char path[4096];
+    char magic[sizeof(INDEX_MAGIC)];
+    index_path(filename, path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+    int ret = -1;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        fread(idx, sizeof(uint64_t), 3, fp) != 3 ||
+        idx->trace_size != (uint64_t)st->st_size ||
+        idx->trace_mtime != (uint64_t)st->st_mtime) {
+        goto out;
+    }
+    idx->checkpoints = malloc(idx->nb_checkpoints * sizeof(checkpoint_t));
+    if (fread(idx->checkpoints, sizeof(checkpoint_t), idx->nb_checkpoints,
+              fp) != idx->nb_checkpoints) {
+        free(idx->checkpoints);
+        goto out;
+    }
+    ret = 0;
+out:
+    fclose(fp);
+    return ret;
+}
+
+/* Best effort: the index is rebuilt if it can't be saved */
+static void index_save(char *filename, index_t *idx) {
+    char path[4096];
+    index_path(filename, path, sizeof(path));
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return;
+    fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), fp);
+    fwrite(idx, sizeof(uint64_t), 3, fp);
+    fwrite(idx->checkpoints, sizeof(checkpoint_t), idx->nb_checkpoints, fp);
+    if (fclose(fp) != 0) remove(path);
+}
+
+/* One pass over the trace, checkpoint every INDEX_STEP instructions */
+static void index_build(reader_t *r, index_t *idx) {
+    window_t w = {0};
+    size_t nb_inst = 0;
+    size_t capacity = 0;
+    idx->nb_checkpoints = 0;
+    idx->checkpoints = NULL;
+    while (reader_next(r)) {
+        cmd_t *cmd = &r->cmd;
+        if (cmd->id == 'I') {
+            slot_t *s = window_add(&w, cmd->astype.I.id);
+            if (s == NULL) {
+                reader_warn(r, WARN_UNEXPECTED_ID, cmd->astype.I.id);
+                continue;
+            }
+            s->started = true;
+            s->offset = r->offset;
+            s->start = r->time;
+            if (nb_inst++ % INDEX_STEP) continue;
+
+            if (idx->nb_checkpoints == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                idx->checkpoints =
+                    realloc(idx->checkpoints, capacity * sizeof(checkpoint_t));
+                assert(idx->checkpoints);
+            }
+            checkpoint_t *c = &idx->checkpoints[idx->nb_checkpoints++];
+            c->id = cmd->astype.I.id;
+            c->offset = r->offset;
+            c->time = r->time;
+            c->live_offset = w.slots[0].offset;  // Oldest not retired
+            c->live_time = w.slots[0].start;
+        } else if (cmd->id == 'R') {
+            slot_t *s = window_find(&w, cmd->astype.R.id);
+            if (s == NULL) continue;
+            s->retired = true;
+            window_drop_retired(&w);
+        }
+    }
+    free(w.slots);
+}
+
+/* Last checkpoint before the range */
+static checkpoint_t *index_find(index_t *idx, export_range_t range) {
+    size_t lo = 0, hi = idx->nb_checkpoints;  // Search in [lo:hi[
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        checkpoint_t *c = &idx->checkpoints[mid];
+        if ((range.cycles ? c->time : c->id) <= range.first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &idx->checkpoints[lo - 1] : NULL;
+}
+
+/* Slice */
+
+static bool slot_selected(slot_t *s, export_range_t range) {
+    if (s == NULL || !s->started) return false;
+    if (!range.cycles) return true;  // Only ids of the range are started
+    return s->start < range.last && (!s->retired || s->end > range.first);
+}
+
+/* Renumber an instruction id, false if not in the slice. Only labels are
+ * kept after the R. */
+static bool slice_id(window_t *w, export_range_t range, size_t *id,
+                     bool label) {
+    slot_t *s = window_find(w, *id);
+    if (!slot_selected(s, range) || !s->emitted) return false;
+    if (s->closed && !label) return false;
+    *id = s->new_id;
+    return true;
+}
+
+int slice_trace(char *filename, FILE *out, export_range_t range) {
+    if (range.first >= range.last) return -1;
+
+    struct stat st;
+    reader_t r;
+    index_t idx;
+    if (stat(filename, &st) != 0 || reader_open(&r, filename) != 0) return -1;
+    if (index_load(filename, &idx, &st) != 0) {
+        index_build(&r, &idx);
+        idx.trace_size = st.st_size;
+        idx.trace_mtime = st.st_mtime;
+        index_save(filename, &idx);
+    }
+
+    // Resume point: the instruction itself, or the oldest instruction
+    // alive at the checkpoint before the first cycle
+    off_t start_offset = r.header;
+    size_t start_time = 0;
+    checkpoint_t *c = index_find(&idx, range);
+    if (c) {
+        start_offset = range.cycles ? c->live_offset : c->offset;
+        start_time = range.cycles ? c->live_time : c->time;
+    }
+    free(idx.checkpoints);
+
+    // First pass: lifetime of the candidate instructions, up to the end of
+    // the cycle where all of them are retired (labels may follow an R)
+    window_t w = {0};
+    size_t pending = 0;  // Candidates not retired yet
+    bool past = false;   // No more candidates to come
+    off_t stop = -1;
+    reader_seek(&r, start_offset, start_time);
+    while (reader_next(&r)) {
+        cmd_t *cmd = &r.cmd;
+        if (range.cycles) past = r.time >= range.last;
+        if (past && pending == 0 && cmd->id == 'C') {
+            stop = r.offset;
+            break;
+        }
+        if (cmd->id == 'I') {
+            size_t id = cmd->astype.I.id;
+            if (range.cycles ? past : id < range.first || id >= range.last)
+                continue;
+            slot_t *s = window_add(&w, id);
+            if (s == NULL) {
+                reader_warn(&r, WARN_UNEXPECTED_ID, id);
+                continue;
+            }
+            s->started = true;
+            s->start = r.time;
+            pending++;
+            if (!range.cycles) past = id + 1 >= range.last;
+        } else if (cmd->id == 'R') {
+            slot_t *s = window_find(&w, cmd->astype.R.id);
+            if (s == NULL || !s->started || s->retired) continue;
+            s->retired = true;
+            s->end = r.time;
+            pending--;
+        }
+    }
+
+    // Second pass: emit the records of the selected instructions
+    size_t nb_inst = 0;
+    size_t out_time = 0;
+    bool first = true;
+    reader_seek(&r, start_offset, start_time);
+    fprintf(out, "Kanata\t0004\n");
+    while (reader_next(&r) && (stop < 0 || r.offset < stop)) {
+        cmd_t *cmd = &r.cmd;
+        bool keep = false;
+        switch (cmd->id) {
+            case 'I': {
+                slot_t *s = window_find(&w, cmd->astype.I.id);
+                if (!slot_selected(s, range) || s->emitted) break;
+                s->emitted = true;
+                s->new_id = nb_inst++;
+                keep = slice_id(&w, range, &cmd->astype.I.id, false);
+                break;
+            }
+            case 'L':
+                keep = slice_id(&w, range, &cmd->astype.L.id, true);
+                break;
+            case 'S':
+            case 'E':
+                keep = slice_id(&w, range, &cmd->astype.S.id, false);
+                break;
+            case 'R': {
+                slot_t *s = window_find(&w, cmd->astype.R.id);
+                keep = slice_id(&w, range, &cmd->astype.R.id, false);
+                if (keep) s->closed = true;
+                break;
+            }
+            case 'W':
+                keep =
+                    slice_id(&w, range, &cmd->astype.w.id_consumer, false) &&
+                    slice_id(&w, range, &cmd->astype.w.id_producer, false);
+                break;
+        }
+        if (!keep) continue;
+
+        // Time, relative to the previous record kept
+        cmd_t cycle = {'C', {.C = {first, first ? r.time : r.time - out_time}}};
+        if (first || cycle.astype.C.value) cmd_print(&cycle, out);
+        first = false;
+        out_time = r.time;
+        cmd_print(cmd, out);
+    }
+
+    reader_close(&r);
+    free(w.slots);
+    return (nb_inst && !ferror(out)) ? 0 : -1;
+}
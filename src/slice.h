@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "export.h"
+
+/* Write to `out` a self-contained trace holding the instructions of
+ * `range` (by id or alive during the cycles), renumbered from 0. A
+ * checkpoint index is kept next to the trace (<filename>.kidx) to start
+ * reading close to the range. */
+int slice_trace(char *filename, FILE *out, export_range_t range);
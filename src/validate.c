@@ -0,0 +1,209 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parser.h"
+
+#define MAX_DIAGNOSTICS 20 /* Printed per kind, the others are counted */
+#define MAX_LANES 64       /* Lanes checked for S/E pairing */
+
+enum { INST_UNSEEN, INST_STARTED, INST_RETIRED };
+
+typedef enum diag {
+    DIAG_TIME_BACK,
+    DIAG_NEGATIVE_STEP,
+    DIAG_INVALID_ID,
+    DIAG_STARTED,
+    DIAG_NOT_STARTED,
+    DIAG_RETIRED,
+    DIAG_NO_STAGE,
+    DIAG_NO_RETIRE,
+    NB_DIAGS,
+} diag_t;
+
+static char *diag_msgs[NB_DIAGS] = {
+    [DIAG_TIME_BACK] = "time goes back to",
+    [DIAG_NEGATIVE_STEP] = "negative cycle step",
+    [DIAG_INVALID_ID] = "invalid instruction",
+    [DIAG_STARTED] = "instruction already started",
+    [DIAG_NOT_STARTED] = "instruction not started",
+    [DIAG_RETIRED] = "instruction retired",
+    [DIAG_NO_STAGE] = "no stage started on lane",
+    [DIAG_NO_RETIRE] = "no R for instruction",
+};
+
+/* Per instruction state, allocated once for the whole trace */
+typedef struct inst_check {
+    uint8_t state;
+    uint64_t lanes; /* Lanes with a started stage */
+    size_t line;    /* Line of the I record */
+} inst_check_t;
+
+typedef struct validator {
+    char *filename;
+    size_t counts[NB_DIAGS];
+} validator_t;
+
+static void diagnostic(validator_t *v, diag_t kind, size_t line, char cmd,
+                       size_t value) {
+    if (v->counts[kind]++ < MAX_DIAGNOSTICS) {
+        fprintf(stderr, "%s:%ld: %c: %s %ld\n", v->filename, line, cmd,
+                diag_msgs[kind], value);
+    }
+}
+
+/* Record dropped: the database must never see it */
+static void drop(cmd_t *cmd) {
+    if (cmd->id == 'L') free(cmd->astype.L.str);
+    cmd->id = 0;
+}
+
+/* Check the trace invariants in one pass, without allocation per record:
+ * valid instruction ids, monotonic time, S/E pairing per lane and an R for
+ * every I. Records that would corrupt the database are dropped. With
+ * `repair`, the missing R records are added at the end of the trace.
+ * Return the number of errors. */
+size_t cmd_validate(char *filename, cmd_t **cmds, size_t *size, bool repair) {
+    validator_t v = {filename, {0}};
+
+    // Ids in the file are sequential: they can't exceed the number of I
+    size_t nb_inst = 0;
+    for (size_t i = 0; i < *size; i++) nb_inst += (*cmds)[i].id == 'I';
+    inst_check_t *insts = calloc(nb_inst ? nb_inst : 1, sizeof(inst_check_t));
+
+    bool timed = false;  // Some record already got a time
+    size_t time = 0;
+    for (size_t i = 0; i < *size; i++) {
+        cmd_t *cmd = &(*cmds)[i];
+        size_t line = i + 2;  // Header on line 1
+        size_t id;
+        switch (cmd->id) {
+            case 'C':
+                if (cmd->astype.C.set) {
+                    if (timed && cmd->astype.C.value < time) {
+                        diagnostic(&v, DIAG_TIME_BACK, line, 'C',
+                                   cmd->astype.C.value);
+                        drop(cmd);
+                        continue;
+                    }
+                    time = cmd->astype.C.value;
+                } else if ((long)cmd->astype.C.value < 0) {
+                    diagnostic(&v, DIAG_NEGATIVE_STEP, line, 'C',
+                               cmd->astype.C.value);
+                    drop(cmd);
+                    continue;
+                } else {
+                    time += cmd->astype.C.value;
+                }
+                continue;
+            case 'I':
+                id = cmd->astype.I.id;
+                break;
+            case 'L':
+                id = cmd->astype.L.id;
+                break;
+            case 'S':
+            case 'E':
+                id = cmd->astype.S.id;
+                break;
+            case 'R':
+                id = cmd->astype.R.id;
+                break;
+            case 'W':
+                id = cmd->astype.w.id_consumer;
+                if (id < nb_inst) id = cmd->astype.w.id_producer;
+                if (id >= nb_inst) {
+                    diagnostic(&v, DIAG_INVALID_ID, line, 'W', id);
+                    drop(cmd);
+                }
+                continue;
+            default:  // Already reported by the parser
+                continue;
+        }
+        timed = true;
+
+        if (id >= nb_inst) {
+            diagnostic(&v, DIAG_INVALID_ID, line, cmd->id, id);
+            drop(cmd);
+            continue;
+        }
+        inst_check_t *inst = &insts[id];
+        if (cmd->id == 'I') {
+            if (inst->state != INST_UNSEEN) {
+                diagnostic(&v, DIAG_STARTED, line, 'I', id);
+                drop(cmd);
+                continue;
+            }
+            inst->state = INST_STARTED;
+            inst->line = line;
+            continue;
+        }
+        // Simulators label instructions up to their retirement cycle
+        if (cmd->id == 'L' && inst->state == INST_RETIRED) continue;
+        if (inst->state != INST_STARTED) {
+            diagnostic(&v,
+                       inst->state == INST_UNSEEN ? DIAG_NOT_STARTED
+                                                  : DIAG_RETIRED,
+                       line, cmd->id, id);
+            drop(cmd);
+            continue;
+        }
+
+        size_t lane = cmd->astype.S.id_lane;
+        uint64_t mask = lane < MAX_LANES ? (uint64_t)1 << lane : 0;
+        switch (cmd->id) {
+            case 'S':  // A new stage ends the previous one: E is optional
+                inst->lanes |= mask;
+                break;
+            case 'E':
+                if (mask && !(inst->lanes & mask)) {
+                    diagnostic(&v, DIAG_NO_STAGE, line, 'E', lane);
+                }
+                inst->lanes &= ~mask;
+                break;
+            case 'R':
+                inst->state = INST_RETIRED;
+                inst->lanes = 0;
+                break;
+        }
+    }
+
+    // An R for every I
+    for (size_t id = 0; id < nb_inst; id++) {
+        if (insts[id].state != INST_STARTED) continue;
+        diagnostic(&v, DIAG_NO_RETIRE, insts[id].line, 'I', id);
+    }
+    size_t nb_missing = v.counts[DIAG_NO_RETIRE];
+
+    // Retire them at the end of the trace, as flushed
+    if (repair && nb_missing) {
+        *cmds = realloc(*cmds, (*size + nb_missing) * sizeof(cmd_t));
+        assert(*cmds);
+        for (size_t id = 0; id < nb_inst; id++) {
+            if (insts[id].state != INST_STARTED) continue;
+            cmd_t *cmd = &(*cmds)[(*size)++];
+            cmd->id = 'R';
+            cmd->astype.R.id = id;
+            cmd->astype.R.id_retire = 0;
+            cmd->astype.R.type = 1;
+        }
+    }
+
+    size_t nb_errors = 0;
+    for (diag_t kind = 0; kind < NB_DIAGS; kind++) {
+        if (v.counts[kind] > MAX_DIAGNOSTICS) {
+            fprintf(stderr, "%s: %ld more \"%s\" not shown\n", filename,
+                    v.counts[kind] - MAX_DIAGNOSTICS, diag_msgs[kind]);
+        }
+        if (kind != DIAG_NO_RETIRE) nb_errors += v.counts[kind];
+    }
+    if (nb_errors || nb_missing) {
+        fprintf(stderr, "%s: %ld errors, %ld instructions without R%s\n",
+                filename, nb_errors, nb_missing,
+                repair && nb_missing ? " (repaired)" : "");
+    }
+    free(insts);
+    return nb_errors + nb_missing;
+}